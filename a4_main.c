@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "file.h"
 #include "fat32.h"
 #include "file_sys_32.h"
@@ -40,11 +41,41 @@ int main(int argc, char *argv[])
         printf("Getting %s in %s:\n", argv[3], argv[1]);
         // get file
     }
+    else if (!strcmp(argv[2], "compress"))
+    {
+        if (argc < 4)
+        {
+            printf("Output Filename not Entered\n");
+            exit(EXIT_FAILURE);
+        }
+        printf("Compressing %s to %s:\n", argv[1], argv[3]);
+        // write compressed container
+        compressImage(argv[3]);
+    }
+    else if (!strcmp(argv[2], "frag"))
+    {
+        int worst_count = FRAG_DEFAULT_WORST;
+        if (argc >= 4)
+        {
+            char *end;
+            long count = strtol(argv[3], &end, 10);
+            if (*argv[3] == '\0' || *end != '\0' || count < 0 || count > INT_MAX)
+            {
+                printf("Invalid number of files %s\n", argv[3]);
+                exit(EXIT_FAILURE);
+            }
+            worst_count = (int)count;
+        }
+        printf("%s Fragmentation:\n", argv[1]);
+        // analyze file layout
+        fragmentation(worst_count);
+    }
     else
     {
-        printf("%s is not a valid command. The valid commands are \'info\', \'list\', or \'get\'.\n", argv[2]);
+        printf("%s is not a valid command. The valid commands are \'info\', \'list\', \'get\', \'compress\', or \'frag\'.\n", argv[2]);
         exit(EXIT_FAILURE);
     }
 
+    closeDisk();
     return 0;
 }
@@ -0,0 +1,494 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <errno.h>
+#include "block_cache.h"
+
+// a single cached block, linked into both its hash bucket and its shard's LRU list
+typedef struct cacheEntry_struct
+{
+    uint64_t block;
+    struct cacheEntry_struct *hash_next;
+    struct cacheEntry_struct *lru_prev;
+    struct cacheEntry_struct *lru_next;
+    char data[];
+} cacheEntry;
+
+// one lock stripe of the cache, owns every block whose number maps to it
+typedef struct
+{
+    pthread_mutex_t lock;
+    cacheEntry **buckets;
+    uint64_t bucket_mask;
+    uint32_t shard_shift; // log2 of the number of shards in use
+    cacheEntry *lru_head; // most recently used
+    cacheEntry *lru_tail; // next to be evicted
+    uint64_t blocks_used;
+    uint64_t max_blocks;
+} cacheShard;
+
+// a sequential reader, found through the block it is expected to read next
+typedef struct
+{
+    pthread_mutex_t lock;
+    bool active;
+    uint64_t next_block;
+    uint32_t run;              // consecutive blocks read so far
+    uint64_t prefetched_until; // first block not yet read ahead
+} readStream;
+
+struct blockCache_struct
+{
+    uint64_t block_size;
+    uint32_t max_prefetch;
+    blockFillFn fill;
+    void *ctx;
+    uint32_t shard_count; // power of two, fewer than BLOCK_CACHE_SHARDS when the budget is small
+    cacheShard shards[BLOCK_CACHE_SHARDS];
+    readStream streams[BLOCK_CACHE_STREAMS];
+};
+
+// consecutive blocks land in different shards so a sequential scan spreads its locking
+static cacheShard *shardFor(blockCache *cache, uint64_t block)
+{
+    return &cache->shards[block & (cache->shard_count - 1)];
+}
+
+static uint64_t bucketFor(cacheShard *shard, uint64_t block)
+{
+    return (block >> shard->shard_shift) & shard->bucket_mask;
+}
+
+static void lruUnlink(cacheShard *shard, cacheEntry *entry)
+{
+    if (entry->lru_prev != NULL)
+    {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else
+    {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL)
+    {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        shard->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lruPushFront(cacheShard *shard, cacheEntry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL)
+    {
+        shard->lru_head->lru_prev = entry;
+    }
+    shard->lru_head = entry;
+    if (shard->lru_tail == NULL)
+    {
+        shard->lru_tail = entry;
+    }
+}
+
+// find a block in a shard without touching its LRU position, shard lock must be held
+static cacheEntry *shardFind(cacheShard *shard, uint64_t block)
+{
+    cacheEntry *entry = shard->buckets[bucketFor(shard, block)];
+    while (entry != NULL && entry->block != block)
+    {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+// find a block in a shard and mark it as most recently used, shard lock must be held
+static cacheEntry *shardLookup(cacheShard *shard, uint64_t block)
+{
+    cacheEntry *entry = shardFind(shard, block);
+    if (entry != NULL && entry != shard->lru_head)
+    {
+        lruUnlink(shard, entry);
+        lruPushFront(shard, entry);
+    }
+    return entry;
+}
+
+// remove the least recently used block from a shard and hand back its memory, shard lock must be held
+static cacheEntry *shardEvict(cacheShard *shard)
+{
+    cacheEntry *victim = shard->lru_tail;
+    assert(victim != NULL);
+    lruUnlink(shard, victim);
+    cacheEntry **link = &shard->buckets[bucketFor(shard, victim->block)];
+    while (*link != victim)
+    {
+        link = &(*link)->hash_next;
+    }
+    *link = victim->hash_next;
+    shard->blocks_used--;
+    return victim;
+}
+
+/*
+    Double the hash table of a shard once it holds as many blocks as buckets.
+    If the larger table cannot be allocated the shard keeps its current one.
+    Shard lock must be held.
+*/
+static void shardGrow(cacheShard *shard)
+{
+    uint64_t bucket_count = (shard->bucket_mask + 1) * 2;
+    cacheEntry **buckets = (cacheEntry **)calloc(bucket_count, sizeof(cacheEntry *));
+    if (buckets == NULL)
+    {
+        return;
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_mask = bucket_count - 1;
+    //every cached block is on the LRU list, relink them all into the new table
+    for (cacheEntry *entry = shard->lru_head; entry != NULL; entry = entry->lru_next)
+    {
+        uint64_t bucket = bucketFor(shard, entry->block);
+        entry->hash_next = shard->buckets[bucket];
+        shard->buckets[bucket] = entry;
+    }
+}
+
+// add a block to a shard unless another reader already did, shard lock must be held
+static void shardInsert(blockCache *cache, cacheShard *shard, uint64_t block, const char *data)
+{
+    cacheEntry *entry = shardFind(shard, block);
+    if (entry != NULL)
+    {
+        return;
+    }
+
+    if (shard->blocks_used >= shard->max_blocks)
+    {
+        entry = shardEvict(shard);
+    }
+    else
+    {
+        entry = (cacheEntry *)malloc(sizeof(cacheEntry) + cache->block_size);
+        assert(entry != NULL);
+        if (shard->blocks_used >= shard->bucket_mask + 1)
+        {
+            shardGrow(shard);
+        }
+    }
+    entry->block = block;
+    memcpy(entry->data, data, cache->block_size);
+    uint64_t bucket = bucketFor(shard, block);
+    entry->hash_next = shard->buckets[bucket];
+    shard->buckets[bucket] = entry;
+    lruPushFront(shard, entry);
+    shard->blocks_used++;
+}
+
+// copy part of a block out of the cache, returns false on a miss
+static bool copyFromCache(blockCache *cache, uint64_t block, uint64_t offset, char *dest, uint64_t length)
+{
+    cacheShard *shard = shardFor(cache, block);
+    pthread_mutex_lock(&shard->lock);
+    cacheEntry *entry = shardLookup(shard, block);
+    if (entry != NULL)
+    {
+        memcpy(dest, entry->data + offset, length);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry != NULL;
+}
+
+// check if a block is cached without counting it as a use
+static bool isCached(blockCache *cache, uint64_t block)
+{
+    cacheShard *shard = shardFor(cache, block);
+    pthread_mutex_lock(&shard->lock);
+    bool cached = shardFind(shard, block) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+    return cached;
+}
+
+/*
+    Read a run of blocks from the backing store in one call and cache all of them.
+    When dest is set, length bytes at offset of the first block are copied into it.
+*/
+static void fillBlocks(blockCache *cache, uint64_t first_block, uint64_t block_count, uint64_t offset, char *dest, uint64_t length)
+{
+    char *data = (char *)malloc(block_count * cache->block_size);
+    assert(data != NULL);
+    cache->fill(cache->ctx, first_block, block_count, data);
+    if (dest != NULL)
+    {
+        memcpy(dest, data + offset, length);
+    }
+    for (uint64_t i = 0; i < block_count; i++)
+    {
+        cacheShard *shard = shardFor(cache, first_block + i);
+        pthread_mutex_lock(&shard->lock);
+        shardInsert(cache, shard, first_block + i, data + i * cache->block_size);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    free(data);
+}
+
+// read ahead only the blocks in [first_block, end_block) that are not cached yet, one fill per missing run
+static void fetchMissing(blockCache *cache, uint64_t first_block, uint64_t end_block)
+{
+    uint64_t block = first_block;
+    while (block < end_block)
+    {
+        if (isCached(cache, block))
+        {
+            block++;
+            continue;
+        }
+        uint64_t run_end = block + 1;
+        while (run_end < end_block && !isCached(cache, run_end))
+        {
+            run_end++;
+        }
+        fillBlocks(cache, block, run_end - block, 0, NULL, 0);
+        block = run_end;
+    }
+}
+
+/*
+    Decide whether a stream that just read block should read ahead, moving its
+    *prefetched_until mark. Sets *ahead_start and returns the (exclusive) end of
+    the blocks to prefetch, which equals *ahead_start when there is nothing to fetch.
+*/
+static uint64_t planReadAhead(blockCache *cache, uint64_t block, uint32_t run, uint64_t *prefetched_until, uint64_t *ahead_start)
+{
+    *ahead_start = *prefetched_until > block + 1 ? *prefetched_until : block + 1;
+    uint64_t ahead_end = *ahead_start;
+    if (cache->max_prefetch > 0 && run >= BLOCK_CACHE_SEQ_THRESHOLD)
+    {
+        //grow the window with the length of the run
+        uint64_t window = (uint64_t)1 << (run < 16 ? run : 16);
+        if (window > cache->max_prefetch)
+        {
+            window = cache->max_prefetch;
+        }
+        //only top up once less than half of the window is left
+        if (*ahead_start < block + 1 + window / 2)
+        {
+            ahead_end = block + 1 + window;
+            *prefetched_until = ahead_end;
+        }
+    }
+    return ahead_end;
+}
+
+// the stream slot for a reader whose next block is next_block
+static readStream *streamFor(blockCache *cache, uint64_t next_block)
+{
+    return &cache->streams[((next_block * 0x9E3779B97F4A7C15ull) >> 32) & (BLOCK_CACHE_STREAMS - 1)];
+}
+
+/*
+    Record an access to block and decide whether to read ahead.
+    Streams are kept in slots keyed by the block they expect next, so
+    interleaved readers keep separate runs and only lock their own slot.
+    Sets *ahead_start and returns the (exclusive) end of the blocks to prefetch,
+    which equals *ahead_start when there is nothing to fetch.
+*/
+static uint64_t noteAccess(blockCache *cache, uint64_t block, uint64_t *ahead_start)
+{
+    uint64_t ahead_end;
+    //the same block again, such as the next entry of a directory cluster
+    readStream *stream = streamFor(cache, block + 1);
+    pthread_mutex_lock(&stream->lock);
+    if (stream->active && stream->next_block == block + 1)
+    {
+        ahead_end = planReadAhead(cache, block, stream->run, &stream->prefetched_until, ahead_start);
+        pthread_mutex_unlock(&stream->lock);
+        return ahead_end;
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    //continue the stream that was waiting for this block, otherwise start a new one
+    uint32_t run = 0;
+    uint64_t prefetched_until = block + 1;
+    stream = streamFor(cache, block);
+    pthread_mutex_lock(&stream->lock);
+    if (stream->active && stream->next_block == block)
+    {
+        run = stream->run + 1;
+        prefetched_until = stream->prefetched_until;
+        stream->active = false;
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    ahead_end = planReadAhead(cache, block, run, &prefetched_until, ahead_start);
+
+    //park the stream where its next block will look for it
+    stream = streamFor(cache, block + 1);
+    pthread_mutex_lock(&stream->lock);
+    stream->active = true;
+    stream->next_block = block + 1;
+    stream->run = run;
+    stream->prefetched_until = prefetched_until;
+    pthread_mutex_unlock(&stream->lock);
+    return ahead_end;
+}
+
+/*
+    Create a cache of block_size blocks holding at most byte_budget bytes.
+    A budget smaller than one block is raised to one block.
+*/
+blockCache *blockCacheCreate(uint64_t block_size, uint64_t byte_budget, uint32_t max_prefetch, blockFillFn fill, void *ctx)
+{
+    assert(block_size > 0 && fill != NULL);
+    blockCache *cache = (blockCache *)malloc(sizeof(blockCache));
+    assert(cache != NULL);
+    cache->block_size = block_size;
+    cache->fill = fill;
+    cache->ctx = ctx;
+
+    uint64_t total_blocks = byte_budget / block_size;
+    if (total_blocks == 0)
+    {
+        printf("Cache budget of %" PRIu64 " bytes is smaller than one %" PRIu64 " byte block, using %" PRIu64 " bytes\n",
+               byte_budget, block_size, block_size);
+        total_blocks = 1;
+    }
+    //every shard must hold at least one block, so small budgets use fewer shards
+    uint32_t shard_shift = 0;
+    while (((uint64_t)2 << shard_shift) <= total_blocks && ((uint32_t)2 << shard_shift) <= BLOCK_CACHE_SHARDS)
+    {
+        shard_shift++;
+    }
+    cache->shard_count = (uint32_t)1 << shard_shift;
+    //prefetching more than a quarter of the cache would evict what it just read
+    cache->max_prefetch = max_prefetch;
+    if (cache->max_prefetch > total_blocks / 4)
+    {
+        cache->max_prefetch = total_blocks / 4;
+    }
+
+    //hash tables start small and grow with the blocks actually cached
+    uint64_t bucket_count = BLOCK_CACHE_INITIAL_BUCKETS;
+    for (uint32_t i = 0; i < cache->shard_count; i++)
+    {
+        cacheShard *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->buckets = (cacheEntry **)calloc(bucket_count, sizeof(cacheEntry *));
+        assert(shard->buckets != NULL);
+        shard->bucket_mask = bucket_count - 1;
+        shard->shard_shift = shard_shift;
+        shard->lru_head = NULL;
+        shard->lru_tail = NULL;
+        shard->blocks_used = 0;
+        //split the budget exactly, the first shards take the remainder
+        shard->max_blocks = total_blocks / cache->shard_count + (i < total_blocks % cache->shard_count ? 1 : 0);
+    }
+
+    for (int i = 0; i < BLOCK_CACHE_STREAMS; i++)
+    {
+        pthread_mutex_init(&cache->streams[i].lock, NULL);
+        cache->streams[i].active = false;
+    }
+    return cache;
+}
+
+/*
+    Read chars_to_read bytes starting at byte_position of the backing store,
+    serving whole blocks from the cache and filling the ones that are missing.
+*/
+void blockCacheRead(blockCache *cache, uint64_t byte_position, char buffer[], uint64_t chars_to_read)
+{
+    assert(cache != NULL);
+    while (chars_to_read > 0)
+    {
+        uint64_t block = byte_position / cache->block_size;
+        uint64_t offset = byte_position % cache->block_size;
+        uint64_t length = cache->block_size - offset;
+        if (length > chars_to_read)
+        {
+            length = chars_to_read;
+        }
+
+        uint64_t ahead_start;
+        uint64_t ahead_end = noteAccess(cache, block, &ahead_start);
+        if (!copyFromCache(cache, block, offset, buffer, length))
+        {
+            //a miss right before the read ahead window is fetched along with its missing head
+            uint64_t run_end = block + 1;
+            if (ahead_start == block + 1)
+            {
+                while (run_end < ahead_end && !isCached(cache, run_end))
+                {
+                    run_end++;
+                }
+                ahead_start = run_end;
+            }
+            fillBlocks(cache, block, run_end - block, offset, buffer, length);
+        }
+        fetchMissing(cache, ahead_start, ahead_end);
+
+        byte_position += length;
+        buffer += length;
+        chars_to_read -= length;
+    }
+}
+
+// release every cached block and the cache itself
+void blockCacheDestroy(blockCache *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < cache->shard_count; i++)
+    {
+        cacheShard *shard = &cache->shards[i];
+        cacheEntry *entry = shard->lru_head;
+        while (entry != NULL)
+        {
+            cacheEntry *next = entry->lru_next;
+            free(entry);
+            entry = next;
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    for (int i = 0; i < BLOCK_CACHE_STREAMS; i++)
+    {
+        pthread_mutex_destroy(&cache->streams[i].lock);
+    }
+    free(cache);
+}
+
+// read the cache budget from the environment, falling back to default_budget
+uint64_t blockCacheBudgetFromEnv(uint64_t default_budget)
+{
+    char *value = getenv(BLOCK_CACHE_BUDGET_ENV);
+    if (value == NULL || *value == '\0')
+    {
+        return default_budget;
+    }
+    //strtoull would quietly accept a sign or leading spaces, so insist on a plain number
+    char *end;
+    errno = 0;
+    unsigned long long budget = strtoull(value, &end, 10);
+    if (!isdigit((unsigned char)value[0]) || *end != '\0' || budget == 0)
+    {
+        printf("Ignoring invalid %s value %s\n", BLOCK_CACHE_BUDGET_ENV, value);
+        return default_budget;
+    }
+    if (errno == ERANGE || budget > BLOCK_CACHE_MAX_BUDGET)
+    {
+        printf("Limiting %s to %" PRIu64 " bytes\n", BLOCK_CACHE_BUDGET_ENV, (uint64_t)BLOCK_CACHE_MAX_BUDGET);
+        return BLOCK_CACHE_MAX_BUDGET;
+    }
+    return (uint64_t)budget;
+}
@@ -0,0 +1,39 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <inttypes.h>
+
+// default byte budget of a cache when no budget is configured
+#define BLOCK_CACHE_DEFAULT_BUDGET (8 * 1024 * 1024)
+// environment variable used to override the data cache budget (in bytes)
+#define BLOCK_CACHE_BUDGET_ENV "FAT32_CACHE_BYTES"
+// largest budget accepted from the environment
+#define BLOCK_CACHE_MAX_BUDGET ((uint64_t)16 * 1024 * 1024 * 1024)
+// hash buckets per shard before any block is cached, must be a power of two
+#define BLOCK_CACHE_INITIAL_BUCKETS 16
+// number of independently locked shards, must be a power of two
+#define BLOCK_CACHE_SHARDS 16
+// consecutive block accesses needed before read ahead starts
+#define BLOCK_CACHE_SEQ_THRESHOLD 2
+// slots for tracking concurrent sequential readers, must be a power of two
+#define BLOCK_CACHE_STREAMS 64
+// largest number of blocks fetched ahead of a sequential reader
+#define BLOCK_CACHE_MAX_PREFETCH 64
+
+/*
+    Fills dest with block_count consecutive blocks starting at first_block.
+    Blocks past the end of the backing store must be zero filled.
+*/
+typedef void (*blockFillFn)(void *ctx, uint64_t first_block, uint64_t block_count, char *dest);
+
+typedef struct blockCache_struct blockCache;
+
+blockCache *blockCacheCreate(uint64_t block_size, uint64_t byte_budget, uint32_t max_prefetch, blockFillFn fill, void *ctx);
+
+void blockCacheRead(blockCache *cache, uint64_t byte_position, char buffer[], uint64_t chars_to_read);
+
+void blockCacheDestroy(blockCache *cache);
+
+uint64_t blockCacheBudgetFromEnv(uint64_t default_budget);
+
+#endif
@@ -0,0 +1,556 @@
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "container.h"
+#include "block_cache.h"
+
+// LZ codec constants, the format follows the LZ4 block layout
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+#define LZ_NIBBLE_MAX 15
+
+struct imageContainer_struct
+{
+    int fd;
+    containerHeader header;
+    containerChunk *index;
+    blockCache *chunkCache; //decompressed chunks
+    char *pinned;           //range of the image kept decompressed in memory
+    uint64_t pinnedStart;
+    uint64_t pinnedLength;
+};
+
+// read exactly chars_to_read bytes at byte_position, exits on error or a short read
+static void readFully(int fd, uint64_t byte_position, void *destination, uint64_t chars_to_read)
+{
+    uint64_t chars_read = 0;
+    while (chars_read < chars_to_read)
+    {
+        ssize_t result = pread(fd, (char *)destination + chars_read, chars_to_read - chars_read, byte_position + chars_read);
+        if (result < 0)
+        {
+            perror("Error reading container");
+            exit(EXIT_FAILURE);
+        }
+        if (result == 0)
+        {
+            printf("Error: container is truncated\n");
+            exit(EXIT_FAILURE);
+        }
+        chars_read += result;
+    }
+}
+
+// write exactly chars_to_write bytes at byte_position, exits on error
+static void writeFully(int fd, uint64_t byte_position, const void *source, uint64_t chars_to_write)
+{
+    uint64_t chars_written = 0;
+    while (chars_written < chars_to_write)
+    {
+        ssize_t result = pwrite(fd, (const char *)source + chars_written, chars_to_write - chars_written, byte_position + chars_written);
+        if (result < 0)
+        {
+            perror("Error writing container");
+            exit(EXIT_FAILURE);
+        }
+        chars_written += result;
+    }
+}
+
+static uint32_t lzRead32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lzHash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// append a length that did not fit in a token nibble, returns false if dst is full
+static bool lzWriteLength(uint8_t *dst, uint32_t *op, uint32_t capacity, uint32_t length)
+{
+    while (length >= 255)
+    {
+        if (*op >= capacity)
+        {
+            return false;
+        }
+        dst[(*op)++] = 255;
+        length -= 255;
+    }
+    if (*op >= capacity)
+    {
+        return false;
+    }
+    dst[(*op)++] = (uint8_t)length;
+    return true;
+}
+
+// append one sequence of literals optionally followed by a match, returns false if dst is full
+static bool lzWriteSequence(uint8_t *dst, uint32_t *op, uint32_t capacity, const uint8_t *literals, uint32_t literal_length, uint32_t offset, uint32_t match_length)
+{
+    uint32_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+    if (*op >= capacity)
+    {
+        return false;
+    }
+    uint8_t token = (uint8_t)(((literal_length < LZ_NIBBLE_MAX ? literal_length : LZ_NIBBLE_MAX) << 4) |
+                              (match_code < LZ_NIBBLE_MAX ? match_code : LZ_NIBBLE_MAX));
+    dst[(*op)++] = token;
+    if (literal_length >= LZ_NIBBLE_MAX && !lzWriteLength(dst, op, capacity, literal_length - LZ_NIBBLE_MAX))
+    {
+        return false;
+    }
+    if (capacity - *op < literal_length)
+    {
+        return false;
+    }
+    memcpy(dst + *op, literals, literal_length);
+    *op += literal_length;
+    if (match_length == 0)
+    {
+        return true;
+    }
+    if (capacity - *op < 2)
+    {
+        return false;
+    }
+    dst[(*op)++] = (uint8_t)(offset & 0xFF);
+    dst[(*op)++] = (uint8_t)(offset >> 8);
+    if (match_code >= LZ_NIBBLE_MAX && !lzWriteLength(dst, op, capacity, match_code - LZ_NIBBLE_MAX))
+    {
+        return false;
+    }
+    return true;
+}
+
+/*
+    Compress src into dst using a greedy single pass LZ77 matcher.
+    Returns the compressed size or 0 if it does not fit in capacity.
+*/
+static uint32_t lzCompress(const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t capacity)
+{
+    uint32_t *table = (uint32_t *)calloc((size_t)1 << LZ_HASH_BITS, sizeof(uint32_t));
+    assert(table != NULL);
+    uint32_t op = 0;
+    uint32_t anchor = 0;
+    uint32_t i = 0;
+    bool fits = true;
+    while (fits && i + LZ_MIN_MATCH <= length)
+    {
+        uint32_t hash = lzHash(lzRead32(src + i));
+        //positions are stored plus one so 0 means empty
+        uint32_t candidate = table[hash];
+        table[hash] = i + 1;
+        if (candidate == 0 || i - (candidate - 1) > LZ_MAX_OFFSET || lzRead32(src + candidate - 1) != lzRead32(src + i))
+        {
+            i++;
+            continue;
+        }
+        candidate--;
+        uint32_t match_length = LZ_MIN_MATCH;
+        while (i + match_length < length && src[candidate + match_length] == src[i + match_length])
+        {
+            match_length++;
+        }
+        fits = lzWriteSequence(dst, &op, capacity, src + anchor, i - anchor, i - candidate, match_length);
+        i += match_length;
+        anchor = i;
+    }
+    //the last sequence only carries the remaining literals
+    if (fits)
+    {
+        fits = lzWriteSequence(dst, &op, capacity, src + anchor, length - anchor, 0, 0);
+    }
+    free(table);
+    return fits ? op : 0;
+}
+
+// read a length continued past its token nibble, returns false on truncated input
+static bool lzReadLength(const uint8_t *src, uint32_t length, uint32_t *ip, uint32_t *value)
+{
+    uint8_t byte;
+    do
+    {
+        if (*ip >= length)
+        {
+            return false;
+        }
+        byte = src[(*ip)++];
+        *value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/*
+    Decompress src into exactly out_length bytes of dst.
+    Returns false if the input is corrupt.
+*/
+static bool lzDecompress(const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t out_length)
+{
+    uint32_t ip = 0;
+    uint32_t op = 0;
+    while (ip < length)
+    {
+        uint8_t token = src[ip++];
+        uint32_t literal_length = token >> 4;
+        if (literal_length == LZ_NIBBLE_MAX && !lzReadLength(src, length, &ip, &literal_length))
+        {
+            return false;
+        }
+        if (literal_length > length - ip || literal_length > out_length - op)
+        {
+            return false;
+        }
+        memcpy(dst + op, src + ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if (ip == length)
+        {
+            break;
+        }
+
+        if (length - ip < 2)
+        {
+            return false;
+        }
+        uint32_t offset = src[ip] | ((uint32_t)src[ip + 1] << 8);
+        ip += 2;
+        uint32_t match_length = token & LZ_NIBBLE_MAX;
+        if (match_length == LZ_NIBBLE_MAX && !lzReadLength(src, length, &ip, &match_length))
+        {
+            return false;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match_length > out_length - op)
+        {
+            return false;
+        }
+        //byte by byte since the match may overlap the bytes being written
+        for (uint32_t i = 0; i < match_length; i++, op++)
+        {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op == out_length;
+}
+
+// number of bytes of the volume held by a chunk, only the last chunk can be short
+static uint32_t chunkLength(containerHeader *header, uint64_t chunk)
+{
+    uint64_t start = chunk * header->CH_ChunkSize;
+    uint64_t remaining = header->CH_ImageSize - start;
+    return remaining < header->CH_ChunkSize ? (uint32_t)remaining : header->CH_ChunkSize;
+}
+
+// fill function of the chunk cache, decompresses each requested chunk
+static void decompressChunks(void *ctx, uint64_t first_chunk, uint64_t chunk_count, char *dest)
+{
+    imageContainer *container = (imageContainer *)ctx;
+    uint32_t chunk_size = container->header.CH_ChunkSize;
+    uint8_t *stored = NULL;
+    for (uint64_t i = 0; i < chunk_count; i++)
+    {
+        uint64_t chunk = first_chunk + i;
+        char *out = dest + i * chunk_size;
+        memset(out, 0, chunk_size);
+        if (chunk >= container->header.CH_ChunkCount)
+        {
+            //past the end of the volume
+            continue;
+        }
+        containerChunk *entry = &container->index[chunk];
+        uint32_t out_length = chunkLength(&container->header, chunk);
+        if (entry->CC_Method == CHUNK_SPARSE)
+        {
+            continue;
+        }
+        else if (entry->CC_Method == CHUNK_RAW)
+        {
+            readFully(container->fd, entry->CC_Offset, out, out_length);
+            continue;
+        }
+        if (stored == NULL)
+        {
+            stored = (uint8_t *)malloc(chunk_size);
+            assert(stored != NULL);
+        }
+        readFully(container->fd, entry->CC_Offset, stored, entry->CC_Length);
+        if (!lzDecompress(stored, entry->CC_Length, (uint8_t *)out, out_length))
+        {
+            printf("Error: chunk %" PRIu64 " of the container is corrupt\n", chunk);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(stored);
+}
+
+// check if the opened file starts with the container magic
+bool containerIsCompressed(int fd)
+{
+    char magic[CONTAINER_MAGIC_LENGTH];
+    if (pread(fd, magic, CONTAINER_MAGIC_LENGTH, 0) != CONTAINER_MAGIC_LENGTH)
+    {
+        return false;
+    }
+    return memcmp(magic, CONTAINER_MAGIC, CONTAINER_MAGIC_LENGTH) == 0;
+}
+
+// report a container that cannot be trusted and stop
+static void corruptContainer(const char *reason)
+{
+    printf("Corrupt container: %s\n", reason);
+    exit(EXIT_FAILURE);
+}
+
+/*
+    Load the header and chunk index of a container and set up its chunk cache.
+    Every size in the header is checked against the file before it is used
+    to allocate or read anything.
+*/
+imageContainer *containerOpen(int fd)
+{
+    struct stat container_stat;
+    if (fstat(fd, &container_stat) < 0)
+    {
+        perror("Error reading container size");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t file_size = (uint64_t)container_stat.st_size;
+    if (file_size < sizeof(containerHeader))
+    {
+        corruptContainer("file is smaller than its header");
+    }
+
+    imageContainer *container = (imageContainer *)malloc(sizeof(imageContainer));
+    assert(container != NULL);
+    container->fd = fd;
+    readFully(fd, 0, &container->header, sizeof(containerHeader));
+    containerHeader *header = &container->header;
+    if (header->CH_Version != CONTAINER_VERSION)
+    {
+        corruptContainer("unsupported version");
+    }
+    if (header->CH_ChunkSize == 0 || header->CH_ChunkSize > CONTAINER_MAX_CHUNK_SIZE)
+    {
+        corruptContainer("chunk size out of range");
+    }
+    uint64_t expected_chunks = header->CH_ImageSize / header->CH_ChunkSize + (header->CH_ImageSize % header->CH_ChunkSize != 0);
+    if (header->CH_ChunkCount != expected_chunks || header->CH_ChunkCount > SIZE_MAX / sizeof(containerChunk))
+    {
+        corruptContainer("chunk count does not match the image size");
+    }
+    uint64_t index_bytes = header->CH_ChunkCount * sizeof(containerChunk);
+    if (header->CH_IndexOffset < sizeof(containerHeader) || header->CH_IndexOffset > file_size ||
+        index_bytes > file_size - header->CH_IndexOffset)
+    {
+        corruptContainer("chunk index lies outside the file");
+    }
+
+    container->index = (containerChunk *)malloc(index_bytes > 0 ? index_bytes : 1);
+    assert(container->index != NULL);
+    readFully(fd, header->CH_IndexOffset, container->index, index_bytes);
+    for (uint64_t i = 0; i < header->CH_ChunkCount; i++)
+    {
+        containerChunk *entry = &container->index[i];
+        if (entry->CC_Method > CHUNK_LZ || entry->CC_Length > header->CH_ChunkSize ||
+            (entry->CC_Method != CHUNK_SPARSE && (entry->CC_Offset > file_size || entry->CC_Length > file_size - entry->CC_Offset)))
+        {
+            printf("Corrupt container: index entry %" PRIu64 " is invalid\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    container->chunkCache = blockCacheCreate(header->CH_ChunkSize, blockCacheBudgetFromEnv(CONTAINER_CHUNK_CACHE_BUDGET), CONTAINER_MAX_PREFETCH, decompressChunks, container);
+    container->pinned = NULL;
+    container->pinnedStart = 0;
+    container->pinnedLength = 0;
+    return container;
+}
+
+// size in bytes of the volume stored in the container
+uint64_t containerImageSize(imageContainer *container)
+{
+    return container->header.CH_ImageSize;
+}
+
+/*
+    Read bytes of the volume, decompressing only the chunks they fall in.
+    Bytes past the end of the volume read as zero.
+*/
+void containerRead(imageContainer *container, uint64_t byte_position, char buffer[], uint64_t chars_to_read)
+{
+    assert(container != NULL);
+    if (container->pinned != NULL && byte_position >= container->pinnedStart &&
+        byte_position - container->pinnedStart + chars_to_read <= container->pinnedLength)
+    {
+        memcpy(buffer, container->pinned + (byte_position - container->pinnedStart), chars_to_read);
+        return;
+    }
+    blockCacheRead(container->chunkCache, byte_position, buffer, chars_to_read);
+}
+
+// keep a range of the volume (such as the FAT) decompressed for the life of the container
+void containerPinRange(imageContainer *container, uint64_t byte_position, uint64_t length)
+{
+    assert(container != NULL);
+    char *pinned = (char *)malloc(length);
+    assert(pinned != NULL);
+    blockCacheRead(container->chunkCache, byte_position, pinned, length);
+    free(container->pinned);
+    container->pinned = pinned;
+    container->pinnedStart = byte_position;
+    container->pinnedLength = length;
+}
+
+// temporary file being written by containerCreate, removed if the program exits before it is renamed
+static char *pendingOutput = NULL;
+
+static void removePendingOutput()
+{
+    if (pendingOutput != NULL)
+    {
+        unlink(pendingOutput);
+    }
+}
+
+// check if every byte of a chunk is zero
+static bool isZeroChunk(const char *data, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i++)
+    {
+        if (data[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+    Convert image_size bytes of a raw volume into a container at output_location.
+    All zero chunks become sparse holes and chunks that do not shrink are stored raw.
+    The container is written to a temporary file and only renamed over
+    output_location once complete, so a failed conversion leaves it untouched.
+*/
+void containerCreate(int source_fd, uint64_t image_size, char *output_location, uint32_t chunk_size)
+{
+    assert(chunk_size > 0);
+    struct stat source_stat;
+    struct stat output_stat;
+    if (fstat(source_fd, &source_stat) < 0)
+    {
+        perror("Error reading image");
+        exit(EXIT_FAILURE);
+    }
+    if (stat(output_location, &output_stat) == 0 && output_stat.st_dev == source_stat.st_dev && output_stat.st_ino == source_stat.st_ino)
+    {
+        printf("%s is the image being compressed, choose another output\n", output_location);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t temp_length = strlen(output_location) + sizeof(".XXXXXX");
+    pendingOutput = (char *)malloc(temp_length);
+    assert(pendingOutput != NULL);
+    snprintf(pendingOutput, temp_length, "%s.XXXXXX", output_location);
+    int out = mkstemp(pendingOutput);
+    if (out < 0)
+    {
+        printf("Cannot create %s\n", output_location);
+        free(pendingOutput);
+        pendingOutput = NULL;
+        exit(EXIT_FAILURE);
+    }
+    atexit(removePendingOutput);
+    fchmod(out, 0644);
+
+    containerHeader header;
+    memset(&header, 0, sizeof(containerHeader));
+    memcpy(header.CH_Magic, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+    header.CH_Version = CONTAINER_VERSION;
+    header.CH_ChunkSize = chunk_size;
+    header.CH_ImageSize = image_size;
+    header.CH_ChunkCount = (image_size + chunk_size - 1) / chunk_size;
+
+    containerChunk *index = (containerChunk *)calloc(header.CH_ChunkCount, sizeof(containerChunk));
+    char *chunk = (char *)malloc(chunk_size);
+    uint8_t *compressed = (uint8_t *)malloc(chunk_size);
+    assert(index != NULL && chunk != NULL && compressed != NULL);
+
+    uint64_t out_position = sizeof(containerHeader);
+    uint64_t sparse_chunks = 0;
+    for (uint64_t i = 0; i < header.CH_ChunkCount; i++)
+    {
+        uint32_t length = chunkLength(&header, i);
+        readFully(source_fd, i * chunk_size, chunk, length);
+        if (isZeroChunk(chunk, length))
+        {
+            index[i].CC_Method = CHUNK_SPARSE;
+            sparse_chunks++;
+            continue;
+        }
+        //a compressed chunk must be strictly smaller than the original to be worth it
+        uint32_t compressed_length = lzCompress((uint8_t *)chunk, length, compressed, length - 1);
+        index[i].CC_Offset = out_position;
+        if (compressed_length > 0)
+        {
+            index[i].CC_Method = CHUNK_LZ;
+            index[i].CC_Length = compressed_length;
+            writeFully(out, out_position, compressed, compressed_length);
+        }
+        else
+        {
+            index[i].CC_Method = CHUNK_RAW;
+            index[i].CC_Length = length;
+            writeFully(out, out_position, chunk, length);
+        }
+        out_position += index[i].CC_Length;
+    }
+
+    header.CH_IndexOffset = out_position;
+    writeFully(out, out_position, index, header.CH_ChunkCount * sizeof(containerChunk));
+    //the header goes last so an interrupted conversion is never mistaken for a valid container
+    writeFully(out, 0, &header, sizeof(containerHeader));
+    out_position += header.CH_ChunkCount * sizeof(containerChunk);
+    if (close(out) < 0)
+    {
+        perror("Error closing container");
+        exit(EXIT_FAILURE);
+    }
+    if (rename(pendingOutput, output_location) < 0)
+    {
+        perror("Error renaming container into place");
+        exit(EXIT_FAILURE);
+    }
+    free(pendingOutput);
+    pendingOutput = NULL;
+
+    printf("Chunks: %" PRIu64 " (%" PRIu64 " sparse)\n", header.CH_ChunkCount, sparse_chunks);
+    printf("Image Size: %" PRIu64 " bytes\n", image_size);
+    printf("Container Size: %" PRIu64 " bytes\n", out_position);
+    free(index);
+    free(chunk);
+    free(compressed);
+}
+
+// release the index, cache and pinned range of a container
+void containerClose(imageContainer *container)
+{
+    if (container == NULL)
+    {
+        return;
+    }
+    blockCacheDestroy(container->chunkCache);
+    free(container->index);
+    free(container->pinned);
+    free(container);
+}
@@ -0,0 +1,82 @@
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+/**
+ * Compressed image container. The volume is split into fixed size chunks that
+ * are compressed independently, followed by an index holding the location of
+ * every chunk so any byte of the volume can be reached by decompressing one chunk.
+ *
+ * Layout: header | chunk data ... | index (CH_ChunkCount entries)
+ */
+
+#define CONTAINER_MAGIC "F32ZIMG"
+#define CONTAINER_MAGIC_LENGTH 8
+#define CONTAINER_VERSION 1
+#define CONTAINER_DEFAULT_CHUNK_SIZE (64 * 1024)
+// largest chunk size accepted when opening a container
+#define CONTAINER_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+// byte budget of the decompressed chunk cache, overridden by BLOCK_CACHE_BUDGET_ENV
+#define CONTAINER_CHUNK_CACHE_BUDGET (16 * 1024 * 1024)
+// chunks read ahead of a sequential reader
+#define CONTAINER_MAX_PREFETCH 4
+
+// chunk storage methods
+// chunk is all zero and takes no space in the file
+#define CHUNK_SPARSE 0x00
+// chunk did not compress and is stored as is
+#define CHUNK_RAW 0x01
+// chunk is compressed with the built in LZ codec
+#define CHUNK_LZ 0x02
+
+#pragma pack(push)
+#pragma pack(1)
+struct containerHeader_struct
+{
+    // Always CONTAINER_MAGIC, null padded.
+    char CH_Magic[CONTAINER_MAGIC_LENGTH];
+    // Format version of the container.
+    uint32_t CH_Version;
+    // Size in bytes of every chunk except possibly the last.
+    uint32_t CH_ChunkSize;
+    // Size in bytes of the original volume.
+    uint64_t CH_ImageSize;
+    // Number of chunks (and index entries) in the container.
+    uint64_t CH_ChunkCount;
+    // Byte location of the chunk index.
+    uint64_t CH_IndexOffset;
+};
+
+struct containerChunk_struct
+{
+    // Byte location of the stored chunk, 0 for sparse chunks.
+    uint64_t CC_Offset;
+    // Number of bytes stored for the chunk.
+    uint32_t CC_Length;
+    // Storage method, one of the CHUNK_ constants.
+    uint32_t CC_Method;
+};
+#pragma pack(pop)
+
+typedef struct containerHeader_struct containerHeader;
+typedef struct containerChunk_struct containerChunk;
+
+typedef struct imageContainer_struct imageContainer;
+
+bool containerIsCompressed(int fd);
+
+imageContainer *containerOpen(int fd);
+
+uint64_t containerImageSize(imageContainer *container);
+
+void containerRead(imageContainer *container, uint64_t byte_position, char buffer[], uint64_t chars_to_read);
+
+void containerPinRange(imageContainer *container, uint64_t byte_position, uint64_t length);
+
+void containerCreate(int source_fd, uint64_t image_size, char *output_location, uint32_t chunk_size);
+
+void containerClose(imageContainer *container);
+
+#endif
@@ -7,13 +7,21 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
 #include "file.h"
 #include "file_sys_32.h"
+#include "block_cache.h"
+#include "container.h"
+#include "frag.h"
 
 static fat32DE *currDir = NULL;    //the current directory in the navigation
 static fat32BootSector *bs = NULL; //bpb holder
 static int fd = -1;                //file descriptor for directory
 static FSInfo *fsInfo = NULL;
+static blockCache *dataCache = NULL; //cluster cache for the data region
+static uint64_t dataRegionStart = 0; //byte location of cluster 2
+static imageContainer *container = NULL; //set when the image is a compressed container
 uint32_t dataByteStart;
 char filePath[30][250];
 char *name;
@@ -27,12 +35,38 @@ void openDisk(char *drive_location)
         printf("Cannot open %s\n", drive_location);
         exit(EXIT_FAILURE);
     }
+    else if (containerIsCompressed(fd))
+    {
+        container = containerOpen(fd);
+        printf("Successfully opened %s (compressed container)\n", drive_location);
+    }
     else
     {
         printf("Successfully opened %s\n", drive_location);
     }
 }
 
+// release the caches and structures set up for the image, then close it
+void closeDisk()
+{
+    blockCacheDestroy(dataCache);
+    dataCache = NULL;
+    //frees the chunk cache, index and pinned FAT along with it
+    containerClose(container);
+    container = NULL;
+    free(currDir);
+    currDir = NULL;
+    free(fsInfo);
+    fsInfo = NULL;
+    free(bs);
+    bs = NULL;
+    if (fd != -1)
+    {
+        close(fd);
+        fd = -1;
+    }
+}
+
 // load the BBoot Sector and BPB Structure and FAT32 FSInfo Sector, then call helper function to validate BPB parameters
 void initializeStructs()
 {
@@ -43,18 +77,71 @@ void initializeStructs()
     fsInfo = (FSInfo *)malloc(sizeof(FSInfo));
     assert(fsInfo != NULL);
     readBytesToVar(fd, BPB_ROOT + sizeof(fat32BootSector), sizeof(FSInfo), fsInfo);
+    initializeDataCache();
+    if (container != NULL)
+    {
+        //every chain lookup touches the FAT, keep it decompressed
+        containerPinRange(container, getFatByteStart(), (uint64_t)bs->BPB_FATSz32 * bs->BPB_BytesPerSec);
+    }
+}
+
+/*
+    Fill function for the data cache. Reads cluster_count clusters starting
+    at the (zero based) data cluster first_cluster with a single read.
+*/
+static void readClustersFromDisk(void *ctx, uint64_t first_cluster, uint64_t cluster_count, char *dest)
+{
+    int disk = *(int *)ctx;
+    uint64_t bytes_per_cluster = (uint64_t)bs->BPB_BytesPerSec * bs->BPB_SecPerClus;
+    uint64_t chars_to_read = cluster_count * bytes_per_cluster;
+    uint64_t byte_position = dataRegionStart + first_cluster * bytes_per_cluster;
+    uint64_t chars_read = 0;
+    while (chars_read < chars_to_read)
+    {
+        ssize_t result = pread(disk, dest + chars_read, chars_to_read - chars_read, byte_position + chars_read);
+        if (result < 0)
+        {
+            perror("Error reading cluster");
+            exit(EXIT_FAILURE);
+        }
+        if (result == 0)
+        {
+            //past the end of the image
+            memset(dest + chars_read, 0, chars_to_read - chars_read);
+            break;
+        }
+        chars_read += result;
+    }
+}
+
+/*
+    Set up the cluster cache that sits in front of every read of the data region.
+    A compressed container already caches its decompressed chunks, so its
+    reads skip this cache rather than being cached (and read ahead) twice.
+*/
+void initializeDataCache()
+{
+    if (container != NULL)
+    {
+        return;
+    }
+    uint64_t bytes_per_cluster = (uint64_t)bs->BPB_BytesPerSec * bs->BPB_SecPerClus;
+    uint64_t budget = blockCacheBudgetFromEnv(BLOCK_CACHE_DEFAULT_BUDGET);
+    dataRegionStart = (uint64_t)getDataSectorStart() * bs->BPB_BytesPerSec;
+    dataCache = blockCacheCreate(bytes_per_cluster, budget, BLOCK_CACHE_MAX_PREFETCH, readClustersFromDisk, &fd);
 }
 
 // Read bytes from a device into a variable.
 void readBytesToVar(int fd, uint64_t byte_position, uint64_t num_bytes_to_read, void *destination)
 {
     assert(fd != -1);
-    if (lseek(fd, byte_position, SEEK_SET) < 0)
+    if (container != NULL)
     {
-        perror("Error lseeking: ");
-        exit(EXIT_FAILURE);
+        containerRead(container, byte_position, destination, num_bytes_to_read);
+        return;
     }
-    int bytes_read = read(fd, destination, num_bytes_to_read);
+    //pread keeps this safe to call from several threads at once
+    ssize_t bytes_read = pread(fd, destination, num_bytes_to_read, byte_position);
     if (bytes_read < 0)
     {
         perror("Error reading bytes");
@@ -171,10 +258,21 @@ uint64_t getByteLocationFromClusterNumb(fat32BootSector *bs, uint64_t clus_num)
 
 /*
     Given a byte location, read the contents into a buffer.
+    Reads of the data region are served through the cluster cache.
 */
 void readByteLocationToBuffer(int fd, uint64_t byte_position, char buffer[], uint64_t chars_to_read)
 {
     assert(fd != -1);
+    if (dataCache != NULL && byte_position >= dataRegionStart)
+    {
+        blockCacheRead(dataCache, byte_position - dataRegionStart, buffer, chars_to_read);
+        return;
+    }
+    if (container != NULL)
+    {
+        containerRead(container, byte_position, buffer, chars_to_read);
+        return;
+    }
     if (lseek(fd, byte_position, SEEK_SET) < 0)
     {
         printf("Error lseeking: ");
@@ -195,19 +293,8 @@ void readByteLocationToBuffer(int fd, uint64_t byte_position, char buffer[], uin
 void readByteLocationToFile(int fd, FILE *fp, uint64_t byte_position, uint64_t chars_to_read)
 {
     char buffer[chars_to_read];
-    assert(fd != -1);
-    if (lseek(fd, byte_position, SEEK_SET) < 0)
-    {
-        printf("Error lseeking: ");
-        exit(EXIT_FAILURE);
-    }
-    int chars_read = read(fd, buffer, chars_to_read);
-    if (chars_read < 0)
-    {
-        printf("Error reading cluster");
-        exit(EXIT_FAILURE);
-    }
-    fwrite(buffer, sizeof(char), sizeof(char) * chars_read, fp);
+    readByteLocationToBuffer(fd, byte_position, buffer, chars_to_read);
+    fwrite(buffer, sizeof(char), sizeof(char) * chars_to_read, fp);
 }
 
 // checks if it is a valid directory
@@ -318,7 +405,7 @@ char *getNames(fat32DE *currFile)
     // char fileFormat[3];
     char dot[2];
 
-    name = (char *)malloc(sizeof(char) * 11);
+    name = (char *)calloc(DIR_Name_LENGTH + 1, sizeof(char));
     dot[0] = '.';
     dot[1] = '\0';
     memcpy(name, currFile->DIR_Name, 11); //copy name from the disk into name string
@@ -336,8 +423,7 @@ void list()
 // print contents of a directory
 void printDirectory(int level, uint32_t offset, uint32_t cluster)
 {
-    int seek;
-    int currSector;
+    uint64_t seek;
     int currLevel = level;
     char *temp;
     uint32_t currCluster;
@@ -347,30 +433,16 @@ void printDirectory(int level, uint32_t offset, uint32_t cluster)
     assert(currFile != NULL);
 
     //get the current position on disk
-    int currSeek = lseek(fd, offset * bs->BPB_BytesPerSec, SEEK_SET);
+    uint64_t currSeek = (uint64_t)offset * bs->BPB_BytesPerSec;
     int loop = (bs->BPB_BytesPerSec * (uint64_t)bs->BPB_SecPerClus) / 32;
 
     for (int i = 0; i < loop; i++)
     {
-        //keep seeking through the disk
-        seek = lseek(fd, currSeek + i * 32, SEEK_SET);
-
-        //seek failed
-        if (seek == -1)
-        {
-            printf("Error: Failed to seek");
-            exit(EXIT_FAILURE);
-        }
+        //keep moving through the directory cluster
+        seek = currSeek + i * 32;
 
-        //read the current directory from the disk
-        currSector = read(fd, currFile, sizeof(fat32DE));
-
-        //failed to read
-        if (currSector == -1)
-        {
-            printf("Error: Failed to read directory struct");
-            exit(EXIT_FAILURE);
-        }
+        //read the current directory from the cluster cache
+        readByteLocationToBuffer(fd, seek, (char *)currFile, sizeof(fat32DE));
 
         if (currFile->DIR_Name[0] == 0x00)
         {
@@ -381,7 +453,7 @@ void printDirectory(int level, uint32_t offset, uint32_t cluster)
         if (strncmp(currFile->DIR_Name, ".", 1) != 0 && strncmp(currFile->DIR_Name, "..", 2) != 0)
         {
             // add a dash for every level in the directory path
-            temp = (char *)malloc(sizeof(char) * 5);
+            temp = (char *)calloc(currLevel + 1, sizeof(char));
             for (int i = 0; i < currLevel; i++)
             {
                 strcat(temp, "-");
@@ -394,7 +466,7 @@ void printDirectory(int level, uint32_t offset, uint32_t cluster)
             }
 
             //if directory is readable and contains other files
-            if (currFile->DIR_Attr == 0x01 || currFile->DIR_Attr == 0x10 || seek == (int)dataByteStart)
+            if (currFile->DIR_Attr == 0x01 || currFile->DIR_Attr == 0x10 || seek == dataByteStart)
             {
                 //print the directory name
                 printf("\n%sDirectory: %s\n", temp, getNames(currFile));
@@ -417,8 +489,7 @@ void printDirectory(int level, uint32_t offset, uint32_t cluster)
     uint32_t search = getFatByteStart() + cluster * 4;
     uint32_t nextCluster;
 
-    lseek(fd, search, SEEK_SET); //search next part of disk
-    read(fd, &nextCluster, 4);   //read next cluster
+    readBytesToVar(fd, search, sizeof(uint32_t), &nextCluster); //read next cluster
     nextCluster = nextCluster & 0x0FFFFFFF;
 
     if (nextCluster != 0x0FFFFFFF)
@@ -426,3 +497,221 @@ void printDirectory(int level, uint32_t offset, uint32_t cluster)
         printDirectory(currLevel, (nextCluster - 2) * bs->BPB_SecPerClus + getDataSectorStart(), nextCluster); //recursively print
     }
 }
+
+/*
+    Convert the volume in the opened image into a compressed container at output_location.
+    The size comes from the boot sector, since fstat reports 0 for block devices.
+*/
+void compressImage(char *output_location)
+{
+    if (container != NULL)
+    {
+        printf("The image is already a compressed container\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t total_sectors = bs->BPB_TotSec16 != 0 ? bs->BPB_TotSec16 : bs->BPB_TotSec32;
+    uint64_t volume_size = total_sectors * bs->BPB_BytesPerSec;
+    off_t image_size = lseek(fd, 0, SEEK_END);
+    if (image_size < 0)
+    {
+        perror("Error reading image size");
+        exit(EXIT_FAILURE);
+    }
+    if ((uint64_t)image_size < volume_size)
+    {
+        printf("The image is %" PRIu64 " bytes but its volume needs %" PRIu64 " bytes, it may be truncated\n",
+               (uint64_t)image_size, volume_size);
+        exit(EXIT_FAILURE);
+    }
+    containerCreate(fd, volume_size, output_location, CONTAINER_DEFAULT_CHUNK_SIZE);
+}
+
+// a slice of the FAT loaded by one worker
+typedef struct
+{
+    uint32_t *fat;
+    uint64_t first;
+    uint64_t count;
+} fatSlice;
+
+// read one slice of the FAT and strip the reserved high bits of every entry
+static void *loadFatSlice(void *arg)
+{
+    fatSlice *slice = (fatSlice *)arg;
+    uint32_t *entries = slice->fat + slice->first;
+    //findNextListing(bs, n) is the byte location of the FAT entry of cluster n
+    readBytesToVar(fd, findNextListing(bs, slice->first), slice->count * sizeof(uint32_t), entries);
+    for (uint64_t i = 0; i < slice->count; i++)
+    {
+        entries[i] &= NEXT_CLUSTER_MASK;
+    }
+    return NULL;
+}
+
+/*
+    Load the first FAT into memory, split across worker threads.
+    Sets *fat_entries to the number of entries that map to clusters on the volume.
+*/
+uint32_t *loadFat(uint64_t *fat_entries)
+{
+    uint64_t entries = getClusterCount(bs, FAT32_ROOT_DIR_SECTORS) + 2;
+    uint64_t fat_capacity = ((uint64_t)bs->BPB_FATSz32 * bs->BPB_BytesPerSec) / sizeof(uint32_t);
+    if (entries > fat_capacity)
+    {
+        entries = fat_capacity;
+    }
+    uint32_t *fat = (uint32_t *)calloc(entries, sizeof(uint32_t));
+    assert(fat != NULL);
+
+    int thread_count = fragThreadCount();
+    pthread_t threads[FRAG_MAX_THREADS];
+    fatSlice slices[FRAG_MAX_THREADS];
+    uint64_t per_thread = (entries + thread_count - 1) / thread_count;
+    for (int i = 0; i < thread_count; i++)
+    {
+        slices[i].fat = fat;
+        slices[i].first = i * per_thread < entries ? i * per_thread : entries;
+        slices[i].count = entries - slices[i].first < per_thread ? entries - slices[i].first : per_thread;
+        if (pthread_create(&threads[i], NULL, loadFatSlice, &slices[i]) != 0)
+        {
+            //fall back to loading the slice on this thread
+            threads[i] = pthread_self();
+            loadFatSlice(&slices[i]);
+        }
+    }
+    for (int i = 0; i < thread_count; i++)
+    {
+        if (!pthread_equal(threads[i], pthread_self()))
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    *fat_entries = entries;
+    return fat;
+}
+
+// build "NAME.EXT" from the padded short name of a directory entry
+static void formatShortName(fat32DE *entry, char out[])
+{
+    int length = 0;
+    for (int i = 0; i < 8 && entry->DIR_Name[i] != ' '; i++)
+    {
+        out[length++] = entry->DIR_Name[i];
+    }
+    if (entry->DIR_Name[8] != ' ')
+    {
+        out[length++] = '.';
+        for (int i = 8; i < DIR_Name_LENGTH && entry->DIR_Name[i] != ' '; i++)
+        {
+            out[length++] = entry->DIR_Name[i];
+        }
+    }
+    out[length] = '\0';
+}
+
+/*
+    Walk every directory reachable from the root and collect the files in them.
+    Directory chains are followed through the in memory FAT.
+*/
+fragFile *collectFiles(uint32_t *fat, uint64_t fat_entries, uint64_t *file_count)
+{
+    uint64_t bytes_per_cluster = (uint64_t)bs->BPB_BytesPerSec * bs->BPB_SecPerClus;
+    uint64_t entries_per_cluster = bytes_per_cluster / sizeof(fat32DE);
+    fat32DE *entries = (fat32DE *)malloc(bytes_per_cluster);
+    //directories still to visit, as first cluster and path
+    uint64_t stack_size = 0;
+    uint64_t stack_capacity = 64;
+    fragFile *stack = (fragFile *)malloc(stack_capacity * sizeof(fragFile));
+    uint64_t files_capacity = 256;
+    fragFile *files = (fragFile *)malloc(files_capacity * sizeof(fragFile));
+    //guards against directories that link back to a parent
+    bool *visited = (bool *)calloc(fat_entries, sizeof(bool));
+    assert(entries != NULL && stack != NULL && files != NULL && visited != NULL);
+
+    *file_count = 0;
+    stack[stack_size].firstCluster = bs->BPB_RootClus;
+    stack[stack_size].path[0] = '\0';
+    stack_size++;
+    while (stack_size > 0)
+    {
+        fragFile dir = stack[--stack_size];
+        uint64_t cluster = dir.firstCluster;
+        bool end_of_dir = false;
+        while (!end_of_dir && cluster >= 2 && cluster < fat_entries && !visited[cluster])
+        {
+            visited[cluster] = true;
+            readByteLocationToBuffer(fd, getByteLocationFromClusterNumb(bs, cluster), (char *)entries, bytes_per_cluster);
+            for (uint64_t i = 0; i < entries_per_cluster; i++)
+            {
+                fat32DE *entry = &entries[i];
+                if (entry->DIR_Name[0] == 0x00)
+                {
+                    end_of_dir = true;
+                    break;
+                }
+                if (!isDIRValid(entry->DIR_Name) || entry->DIR_Name[0] == '.' ||
+                    (entry->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME || (entry->DIR_Attr & ATTR_VOLUME_ID) != 0)
+                {
+                    continue;
+                }
+
+                char short_name[DIR_Name_LENGTH + 2];
+                formatShortName(entry, short_name);
+                fragFile found;
+                memset(&found, 0, sizeof(fragFile));
+                found.firstCluster = (uint32_t)getClusterNumber(entry->DIR_FstClusHI, entry->DIR_FstClusLO);
+                found.size = entry->DIR_FileSize;
+                snprintf(found.path, FRAG_PATH_LENGTH, "%.*s/%s", FRAG_PATH_LENGTH - DIR_Name_LENGTH - 3, dir.path, short_name);
+
+                if (isDirectory(entry->DIR_Attr))
+                {
+                    if (stack_size == stack_capacity)
+                    {
+                        stack_capacity *= 2;
+                        stack = (fragFile *)realloc(stack, stack_capacity * sizeof(fragFile));
+                        assert(stack != NULL);
+                    }
+                    stack[stack_size++] = found;
+                }
+                else
+                {
+                    if (*file_count == files_capacity)
+                    {
+                        files_capacity *= 2;
+                        files = (fragFile *)realloc(files, files_capacity * sizeof(fragFile));
+                        assert(files != NULL);
+                    }
+                    files[(*file_count)++] = found;
+                }
+            }
+            cluster = fat[cluster];
+        }
+    }
+
+    free(entries);
+    free(stack);
+    free(visited);
+    return files;
+}
+
+// report how fragmented the files on the volume are
+void fragmentation(int worst_count)
+{
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t fat_entries;
+    uint32_t *fat = loadFat(&fat_entries);
+    uint64_t file_count;
+    fragFile *files = collectFiles(fat, fat_entries, &file_count);
+    fragAnalyze(fat, fat_entries, (uint64_t)bs->BPB_BytesPerSec * bs->BPB_SecPerClus, files, file_count);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed_ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+
+    fragReport(files, file_count, (uint64_t)bs->BPB_BytesPerSec * bs->BPB_SecPerClus, worst_count);
+    printf("Analysis Time: %.1f ms (%" PRIu64 " clusters, %d threads)\n", elapsed_ms, fat_entries - 2, fragThreadCount());
+    free(files);
+    free(fat);
+}
@@ -3,6 +3,7 @@
 
 #include "fat32.h"
 #include "file.h"
+#include "frag.h"
 #include <stdbool.h>
 
 //Maximum Buffer Size for reading Input
@@ -10,8 +11,12 @@
 
 void openDisk(char *drive_location);
 
+void closeDisk();
+
 void initializeStructs();
 
+void initializeDataCache();
+
 void readBytesToVar(int fd, uint64_t byte_position, uint64_t num_bytes_to_read, void *destination);
 
 void validateFAT32BPB();
@@ -56,4 +61,12 @@ void list();
 
 void printDirectory(int level, uint32_t offset, uint32_t cluster);
 
+void compressImage(char *output_location);
+
+uint32_t *loadFat(uint64_t *fat_entries);
+
+fragFile *collectFiles(uint32_t *fat, uint64_t fat_entries, uint64_t *file_count);
+
+void fragmentation(int worst_count);
+
 #endif
@@ -0,0 +1,227 @@
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "fat32.h"
+#include "file.h"
+#include "frag.h"
+
+// histogram buckets of extents per file, each bucket holds up to its bound
+#define FRAG_BUCKETS 7
+static const uint32_t bucketBounds[FRAG_BUCKETS] = {1, 2, 4, 8, 16, 64, UINT32_MAX};
+static const char *bucketNames[FRAG_BUCKETS] = {"1", "2", "3-4", "5-8", "9-16", "17-64", "65+"};
+
+// a slice of the file list handled by one worker
+typedef struct
+{
+    const uint32_t *fat;
+    uint64_t fatEntries;
+    uint64_t bytesPerCluster;
+    fragFile *files;
+    uint64_t fileCount;
+} fragWork;
+
+// number of worker threads to use, one per online processor
+int fragThreadCount()
+{
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors < 1)
+    {
+        return 1;
+    }
+    return processors > FRAG_MAX_THREADS ? FRAG_MAX_THREADS : (int)processors;
+}
+
+/*
+    Follow the cluster chain of a file and split it into extents,
+    runs of clusters that are contiguous on disk. The walk stops as broken
+    once the chain is longer than the file size allows, so a looped or
+    cross linked chain costs no more than a healthy one.
+*/
+static void analyzeChain(const uint32_t *fat, uint64_t fat_entries, uint64_t bytes_per_cluster, fragFile *file)
+{
+    file->clusters = 0;
+    file->extents = 0;
+    file->largestGap = 0;
+    file->broken = false;
+    if (file->firstCluster == 0)
+    {
+        //empty files own no clusters
+        return;
+    }
+
+    uint64_t max_clusters = (file->size + bytes_per_cluster - 1) / bytes_per_cluster + FRAG_CHAIN_SLACK;
+    uint64_t curr = file->firstCluster;
+    uint64_t prev = 0;
+    while (true)
+    {
+        if (curr < 2 || curr >= fat_entries || file->clusters >= max_clusters)
+        {
+            //points outside the FAT or runs past the end of the file
+            file->broken = true;
+            return;
+        }
+        if (file->clusters == 0 || curr != prev + 1)
+        {
+            if (file->clusters > 0)
+            {
+                uint64_t gap = curr > prev ? curr - prev - 1 : prev - curr + 1;
+                if (gap > file->largestGap)
+                {
+                    file->largestGap = (uint32_t)gap;
+                }
+            }
+            file->extents++;
+        }
+        file->clusters++;
+        prev = curr;
+        curr = fat[curr];
+        if (curr > MAX_CLUSTER_NUMBER)
+        {
+            //end of chain marker, a bad cluster (MAX_CLUSTER_NUMBER) is outside the FAT and caught as broken above
+            break;
+        }
+    }
+}
+
+static void *analyzeSlice(void *arg)
+{
+    fragWork *work = (fragWork *)arg;
+    for (uint64_t i = 0; i < work->fileCount; i++)
+    {
+        analyzeChain(work->fat, work->fatEntries, work->bytesPerCluster, &work->files[i]);
+    }
+    return NULL;
+}
+
+// split the files between worker threads and compute the extents of every chain
+void fragAnalyze(const uint32_t *fat, uint64_t fat_entries, uint64_t bytes_per_cluster, fragFile *files, uint64_t file_count)
+{
+    int thread_count = fragThreadCount();
+    if ((uint64_t)thread_count > file_count)
+    {
+        thread_count = file_count > 0 ? (int)file_count : 1;
+    }
+    pthread_t threads[FRAG_MAX_THREADS];
+    fragWork work[FRAG_MAX_THREADS];
+    uint64_t per_thread = (file_count + thread_count - 1) / thread_count;
+    for (int i = 0; i < thread_count; i++)
+    {
+        uint64_t first = i * per_thread;
+        work[i].fat = fat;
+        work[i].fatEntries = fat_entries;
+        work[i].bytesPerCluster = bytes_per_cluster;
+        work[i].files = files + (first < file_count ? first : file_count);
+        work[i].fileCount = first >= file_count ? 0 : (file_count - first < per_thread ? file_count - first : per_thread);
+        if (pthread_create(&threads[i], NULL, analyzeSlice, &work[i]) != 0)
+        {
+            //fall back to doing the slice on this thread
+            threads[i] = pthread_self();
+            analyzeSlice(&work[i]);
+        }
+    }
+    for (int i = 0; i < thread_count; i++)
+    {
+        if (!pthread_equal(threads[i], pthread_self()))
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+// order files from most to least fragmented
+static int compareFragmentation(const void *a, const void *b)
+{
+    const fragFile *left = *(const fragFile **)a;
+    const fragFile *right = *(const fragFile **)b;
+    if (left->extents != right->extents)
+    {
+        return left->extents < right->extents ? 1 : -1;
+    }
+    if (left->largestGap != right->largestGap)
+    {
+        return left->largestGap < right->largestGap ? 1 : -1;
+    }
+    return strcmp(left->path, right->path);
+}
+
+// print the volume wide summary, histogram, worst files and extraction estimate
+void fragReport(fragFile *files, uint64_t file_count, uint64_t bytes_per_cluster, int worst_count)
+{
+    uint64_t histogram[FRAG_BUCKETS] = {0};
+    uint64_t empty_files = 0;
+    uint64_t fragmented_files = 0;
+    uint64_t broken_files = 0;
+    uint64_t total_extents = 0;
+    uint64_t total_bytes = 0;
+    uint64_t nonempty_files = 0;
+    fragFile **ranked = (fragFile **)malloc((file_count > 0 ? file_count : 1) * sizeof(fragFile *));
+    assert(ranked != NULL);
+
+    for (uint64_t i = 0; i < file_count; i++)
+    {
+        fragFile *file = &files[i];
+        //the layout of a broken chain is unknown, keep it out of every statistic
+        if (file->broken)
+        {
+            broken_files++;
+            continue;
+        }
+        if (file->extents == 0)
+        {
+            empty_files++;
+            continue;
+        }
+        ranked[nonempty_files++] = file;
+        total_extents += file->extents;
+        total_bytes += (uint64_t)file->clusters * bytes_per_cluster;
+        if (file->extents > 1)
+        {
+            fragmented_files++;
+        }
+        int bucket = 0;
+        while (file->extents > bucketBounds[bucket])
+        {
+            bucket++;
+        }
+        histogram[bucket]++;
+    }
+
+    printf("---Fragmentation Report---\n");
+    //a file with an invalid first cluster is only counted as broken, never as empty
+    printf("Files: %" PRIu64 " (%" PRIu64 " empty, %" PRIu64 " broken)\n", file_count, empty_files, broken_files);
+    printf("Fragmented Files: %" PRIu64 " (%.1f%%)\n", fragmented_files,
+           nonempty_files > 0 ? 100.0 * fragmented_files / nonempty_files : 0.0);
+    printf("Total Extents: %" PRIu64 "\n", total_extents);
+    printf("Average Extents per File: %.2f\n", nonempty_files > 0 ? (double)total_extents / nonempty_files : 0.0);
+    printf("Extent Histogram:\n");
+    for (int i = 0; i < FRAG_BUCKETS; i++)
+    {
+        printf("\t%-6s %" PRIu64 "\n", bucketNames[i], histogram[i]);
+    }
+
+    qsort(ranked, nonempty_files, sizeof(fragFile *), compareFragmentation);
+    uint64_t shown = (uint64_t)worst_count < nonempty_files ? (uint64_t)worst_count : nonempty_files;
+    printf("Worst %" PRIu64 " Files:\n", shown);
+    printf("\t%8s %12s %12s  %s\n", "Extents", "Largest Gap", "Size", "Path");
+    for (uint64_t i = 0; i < shown; i++)
+    {
+        printf("\t%8" PRIu32 " %12" PRIu32 " %12" PRIu32 "  %s\n", ranked[i]->extents, ranked[i]->largestGap,
+               ranked[i]->size, ranked[i]->path);
+    }
+
+    //one seek to reach each file plus one for every extra extent
+    uint64_t seeks = total_extents;
+    uint64_t extra_seeks = total_extents - nonempty_files;
+    double seek_ms = seeks * FRAG_SEEK_MS;
+    double transfer_ms = total_bytes * 1000.0 / FRAG_TRANSFER_BYTES_PER_SEC;
+    printf("Estimated Sequential Extraction (%.1f ms seek, %.0f MB/s):\n", FRAG_SEEK_MS, FRAG_TRANSFER_BYTES_PER_SEC / 1000000);
+    printf("\tSeeks: %" PRIu64 " (%" PRIu64 " from fragmentation)\n", seeks, extra_seeks);
+    printf("\tSeek Time: %.1f ms\n", seek_ms);
+    printf("\tTransfer Time: %.1f ms\n", transfer_ms);
+    printf("\tTotal: %.1f ms (%.1f ms if defragmented)\n", seek_ms + transfer_ms, (seeks - extra_seeks) * FRAG_SEEK_MS + transfer_ms);
+    free(ranked);
+}
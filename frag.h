@@ -0,0 +1,37 @@
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define FRAG_PATH_LENGTH 256
+// number of files listed in the worst files table when no count is given
+#define FRAG_DEFAULT_WORST 10
+// upper bound on the worker threads used to scan the FAT
+#define FRAG_MAX_THREADS 16
+// clusters a chain may run past its file size before it is treated as broken
+#define FRAG_CHAIN_SLACK 1
+// cost model for sequential extraction from a rotating disk
+#define FRAG_SEEK_MS 8.0
+#define FRAG_TRANSFER_BYTES_PER_SEC (100.0 * 1000 * 1000)
+
+// a file found on the volume and the layout of its cluster chain
+typedef struct
+{
+    char path[FRAG_PATH_LENGTH];
+    uint32_t firstCluster;
+    uint32_t size;
+    // filled in by fragAnalyze
+    uint32_t clusters;
+    uint32_t extents;
+    uint32_t largestGap; // clusters skipped between two consecutive extents
+    bool broken;         // chain looped, ran past the file size or left the FAT
+} fragFile;
+
+int fragThreadCount();
+
+void fragAnalyze(const uint32_t *fat, uint64_t fat_entries, uint64_t bytes_per_cluster, fragFile *files, uint64_t file_count);
+
+void fragReport(fragFile *files, uint64_t file_count, uint64_t bytes_per_cluster, int worst_count);
+
+#endif